@@ -0,0 +1,102 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+
+#include "utils.h"
+
+using std::unique_ptr;
+
+// row starts are aligned to this many bytes so that whole scanlines can be
+// handed to vectorized filter code without any unaligned head
+const size_t IMAGE_ALIGN = 32;
+
+/*
+Contiguous pixel buffer for a decoded image. All rows live in one aligned
+allocation, each starting getStride() bytes after the previous one. Only the
+first getLineSize() bytes of a row hold pixel data, the rest is padding.
+
+Pixels are stored exactly as they appear in a defiltered PNG scanline, so a
+row can be defiltered in place and filtered straight out of the buffer.
+*/
+class Image
+{
+private:
+	struct FreeDeleter
+	{
+		void operator()(byte* p) const { free(p); }
+	};
+
+	int mWidth, mHeight;
+	int mBytesPerPixel;
+	size_t mStride;
+
+	unique_ptr<byte, FreeDeleter> mData;
+
+public:
+	Image() : mWidth(0), mHeight(0), mBytesPerPixel(0), mStride(0) {}
+	Image(int width, int height, int bpp) { resize(width, height, bpp); }
+
+	void resize(int width, int height, int bpp);
+	void narrow(int bpp, int first);
+
+	int getWidth() const { return mWidth; }
+	int getHeight() const { return mHeight; }
+	int getBytesPerPixel() const { return mBytesPerPixel; }
+	size_t getStride() const { return mStride; }
+	size_t getLineSize() const { return static_cast<size_t>(mWidth) * mBytesPerPixel; }
+
+	bool empty() const { return !mData; }
+
+	byte* getRow(int y) { return mData.get() + y * mStride; }
+	const byte* getRow(int y) const { return mData.get() + y * mStride; }
+
+	byte* getPixel(int x, int y) { return getRow(y) + x * mBytesPerPixel; }
+	const byte* getPixel(int x, int y) const { return getRow(y) + x * mBytesPerPixel; }
+};
+
+// (re)allocate the buffer for the given dimensions
+// previous contents are discarded, new contents are undefined
+void Image::resize(int width, int height, int bpp)
+{
+	void* p = NULL;
+	size_t size;
+
+	mWidth = width;
+	mHeight = height;
+	mBytesPerPixel = bpp;
+
+	// round stride up to the next multiple of the alignment
+	mStride = (getLineSize() + IMAGE_ALIGN - 1) & ~(IMAGE_ALIGN - 1);
+
+	size = mStride * mHeight;
+	if (size == 0)
+		size = IMAGE_ALIGN;
+
+	if ( posix_memalign(&p, IMAGE_ALIGN, size) != 0 )
+		quit("Could not allocate image buffer.\n");
+
+	mData.reset( static_cast<byte*>(p) );
+}
+
+// drop samples from every pixel in place, keeping bpp samples starting
+// at sample index first (e.g. narrow(1, 2) turns RGB into its B channel)
+// the stride is left unchanged
+void Image::narrow(int bpp, int first)
+{
+	for (int i = 0; i < mHeight; ++i)
+	{
+		byte* line = getRow(i);
+
+		// destination index never passes source index, so a forward
+		// pass can't overwrite samples that haven't been moved yet
+		for (int j = 0; j < mWidth; ++j)
+			memmove(line + j * bpp, line + j * mBytesPerPixel + first, bpp);
+	}
+
+	mBytesPerPixel = bpp;
+}
+
+#endif
@@ -12,7 +12,9 @@
 #include "crc.h"
 #include "compression.h"
 #include "filter.h"
+#include "filter_simd.h"
 #include "Chunk.h"
+#include "Image.h"
 
 using std::cout;
 using std::endl;
@@ -23,8 +25,6 @@ using std::string;
 using std::array;
 using std::vector;
 
-typedef vector<vector<vector<byte>>> byteMatrix;
-
 const array<byte, 8> PNG_HEADER = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
 
 const vector<string> KNOWN_CHUNKS = {"IHDR", "IDAT", "IEND"};
@@ -43,7 +43,7 @@ private:
 
 	vector<Chunk> chunks;
 
-	byteMatrix mImage;
+	Image mImage;
 
 	void decode();
 	void encode();
@@ -52,9 +52,9 @@ private:
 	void readPLTE();
 
 	vector<byte> decompress(const vector<byte>& deflatedData);
-	byteMatrix defilter(const vector<byte>& inflatedData);
+	void defilter(const vector<byte>& inflatedData, Image& image);
 
-	vector<byte> filter(const byteMatrix& image);
+	vector<byte> filter(const Image& image);
 	vector<byte> compress(const vector<byte>& filteredData);
 	
 public:
@@ -80,18 +80,17 @@ void PNG::simplify()
 		grayScale = true;
 		for (int i = 0; i < mHeight; ++i)
 			for (int j = 0; j < mWidth; ++j)
-				if ( !allSame(mImage[i][j], 3) )
+				if ( !allSame(mImage.getPixel(j, i), 3) )
 					grayScale = false;
 
 		if (grayScale)
 		{
-			for (int i = 0; i < mHeight; ++i)
-				for (int j = 0; j < mWidth; ++j)
-					mImage[i][j].erase( mImage[i][j].begin(), mImage[i][j].begin() + 2 );
-
 			colorType = (colorType == 2) ? 0 : 4;
 			mBytesPerPixel = (colorType == 0) ? 1 : 2;
 
+			// keep the last RGB sample (+ alpha) of each pixel
+			mImage.narrow(mBytesPerPixel, 2);
+
 			cout << "RGB values in each pixel were identical. Image has been converted to grayscale.\n\n";
 		}
 	}
@@ -101,7 +100,8 @@ void PNG::simplify()
 // alpha value is not inverted
 void PNG::invert()
 {
-	int p = mImage[0][0].size(); // which samples to invert (skip alpha)
+	int bpp = mImage.getBytesPerPixel();
+	int p = bpp; // which samples to invert (skip alpha)
 
 	if      (p == 1 || p == 2)
 		p = 1;
@@ -109,9 +109,13 @@ void PNG::invert()
 		p = 3;
 
 	for (int i = 0; i < mHeight; ++i)
-		for (int j = 0; j < mWidth; ++j)
+	{
+		byte* line = mImage.getRow(i);
+
+		for (int j = 0; j < mWidth * bpp; j += bpp)
 			for (int k = 0; k < p; ++k)
-				mImage[i][j][k] = 0xFF - mImage[i][j][k];
+				line[j + k] = 0xFF - line[j + k];
+	}
 }
 
 // load an image with filename f, first as chunks, and then
@@ -270,7 +274,7 @@ void PNG::save(string f)
 	cout << "Written image is " << fileSize << " bytes long.\n";
 }
 
-// decode image from a set of chunks to a pixel matrix
+// decode image from a set of chunks to a pixel buffer
 void PNG::decode()
 {
 	vector<byte> idatContents;
@@ -286,7 +290,7 @@ void PNG::decode()
 
 	// decompress/defilter all bytes from IDAT
 	inflatedData = decompress(idatContents);
-	mImage = defilter(inflatedData);
+	defilter(inflatedData, mImage);
 }
 
 // create chunk vector to be written to png file
@@ -359,19 +363,14 @@ vector<byte> PNG::decompress(const vector<byte>& deflatedData)
 	return result;
 }
 
-// defilter the decompressed data stream
+// defilter the decompressed data stream straight into the image buffer
 // only 1 filter method currently exists, which in itself has a total
 // of 4 + 1 filter types (various + no filter)
-// (see filter.h)
-byteMatrix PNG::defilter(const vector<byte>& inflatedData)
+// (see filter.h, filter_simd.h)
+void PNG::defilter(const vector<byte>& inflatedData, Image& image)
 {
-	byteMatrix result;
-	vector<byte> pixels;
-
 	int lineSize = mWidth * mBytesPerPixel;
 
-	int pixIndex;
-
 	int nextFilterType;
 	bool used0 = false,
 		used1 = false,
@@ -379,21 +378,26 @@ byteMatrix PNG::defilter(const vector<byte>& inflatedData)
 		used3 = false,
 		used4 = false;
 
-	// containers to hold current and previous scan lines
-	vector<byte> currScanLine;
-	vector<byte> prevScanLine;
+	// previous scan line starts as all 0x00s
+	vector<byte> zeroLine(lineSize, 0x00);
+	const byte* prevScanLine = zeroLine.data();
 
-	currScanLine.resize(lineSize);
+	// fastest defilter kernels this CPU supports for this pixel size
+	DefilterKernels kernels = getDefilterKernels( mBytesPerPixel, bestDefilterIsa() );
 
-	// previous scan line starts as all 0x00s
-	for (int x = 0; x < lineSize; ++x)
-		prevScanLine.push_back(0x00);
+	image.resize(mWidth, mHeight, mBytesPerPixel);
+
+	if ( inflatedData.size() < static_cast<size_t>(mHeight) * (lineSize + 1) )
+		quit("Decompressed image data is shorter than expected.\n");
 
-	// defilter each scanline
+	// defilter each scanline in place, in its final spot in the image
 	// on each pass, the filter type byte is read and then discarded
-	for (int infIndex = 0; infIndex < inflatedData.size(); ++infIndex)
+	const byte* src = inflatedData.data();
+	for (int i = 0; i < mHeight; ++i, src += lineSize + 1)
 	{
-		nextFilterType = inflatedData[infIndex];
+		byte* currScanLine = image.getRow(i);
+
+		nextFilterType = src[0];
 		if (nextFilterType == 0)
 			used0 = true;
 		else if (nextFilterType == 1)
@@ -406,35 +410,19 @@ byteMatrix PNG::defilter(const vector<byte>& inflatedData)
 			used4 = true;
 
 		// load the next scanline
-		for (int x = 0; x < lineSize; ++x)
-		{
-			++infIndex;
-			currScanLine[x] = inflatedData[infIndex];
-		}
+		memcpy(currScanLine, src + 1, lineSize);
 
 		// defilter current scan line based on type
-		if      (nextFilterType == 0)
-			; // no defilter (do nothing)
-		else if (nextFilterType == 1)
-			deSubLine(currScanLine, mBytesPerPixel);
-		else if (nextFilterType == 2)
-			deUpLine(currScanLine, prevScanLine);
-		else if (nextFilterType == 3)
-			deAverageLine(currScanLine, prevScanLine, mBytesPerPixel);
-		else if (nextFilterType == 4)
-			dePaethLine(currScanLine, prevScanLine, mBytesPerPixel);
-
-		// add the defiltered scan line to raw pixel stream
-		for (byte elem:currScanLine)
-			pixels.push_back(elem);
+		// type 0 needs no defilter (do nothing)
+		if (nextFilterType >= 1 && nextFilterType <= 4)
+			kernels.fn[nextFilterType](currScanLine, prevScanLine, lineSize, mBytesPerPixel);
 
-		// save the defiltered scanline in case it is needed
-		// for the next line's filter type
+		// the defiltered scanline is needed for the next line's filter type
 		prevScanLine = currScanLine;
 	}
 
 	cout << "Inflated data has been defiltered.\n"
-		<< "Defiltered size is " << pixels.size() << " bytes.\n"
+		<< "Defiltered size is " << static_cast<size_t>(mHeight) * lineSize << " bytes.\n"
 		<< "Types used: "
 		<< (used0 ? "0 " : "" )
 		<< (used1 ? "1 " : "" )
@@ -442,30 +430,13 @@ byteMatrix PNG::defilter(const vector<byte>& inflatedData)
 		<< (used3 ? "3 " : "" )
 		<< (used4 ? "4"  : "" )
 		<< "\n\n";
-
-	// convert raw pixel stream to pixel matrix
-	// resize matrix according to mWidth, mHeight, and bytes per pixel
-	result.resize(mHeight);
-	for (int i = 0; i < mHeight; ++i)
-		result[i].resize(mWidth);
-	for (int i = 0; i < mHeight; ++i)
-		for (int j = 0; j < mWidth; ++j)
-			result[i][j].resize(mBytesPerPixel);
-
-	// transfer pixels to matrix
-	pixIndex = 0;
-	for (int i = 0; i < mHeight; ++i)
-		for (int j = 0; j < mWidth; ++j)
-			for (int k = 0; k < mBytesPerPixel; ++k, ++pixIndex)
-				result[i][j][k] = pixels[pixIndex];
-
-	return result;
 }
 
-vector<byte> PNG::filter(const byteMatrix& image)
+// filter rows straight out of the image buffer into the byte stream
+// that gets compressed into IDAT
+vector<byte> PNG::filter(const Image& image)
 {
 	vector<byte> result;
-	vector<byte> pixels;
 
 	int lineSize = mWidth * mBytesPerPixel;
 	int nextFilterType;
@@ -475,29 +446,19 @@ vector<byte> PNG::filter(const byteMatrix& image)
 		used3 = false,
 		used4 = false;
 
-	vector<byte> currScanLine;
-	vector<byte> prevScanLine;
-	vector<byte> temp;
-
-	currScanLine.resize(lineSize);
+	// previous scan line should start as all 0x00
+	vector<byte> zeroLine(lineSize, 0x00);
+	const byte* prevScanLine = zeroLine.data();
 
-	for (int x = 0; x < lineSize; ++x)	// previous scan line should start as all 0x00
-		prevScanLine.push_back(0x00);
-
-	for (int i = 0; i < mHeight; ++i)
-		for (int j = 0; j < mWidth; ++j)
-			for (int k = 0; k < mBytesPerPixel; ++k)
-				pixels.push_back( image[i][j][k] );
+	result.resize( static_cast<size_t>(mHeight) * (lineSize + 1) );
 
-	int pixIndex = 0;
-	for (int i = 0; i < mHeight; ++i)
+	byte* dst = result.data();
+	for (int i = 0; i < mHeight; ++i, dst += lineSize + 1)
 	{
-		for (int x = 0; x < lineSize; ++x, ++pixIndex)
-			currScanLine[x] = pixels[pixIndex];
-
-		temp = currScanLine;	// unfiltered bytes need to be preserved for some types
+		const byte* currScanLine = image.getRow(i);
 
-		nextFilterType = doBestFilter(currScanLine, prevScanLine, mBytesPerPixel);
+		// rows in the image stay unfiltered, so they can be used as prev as-is
+		nextFilterType = doBestFilter(dst + 1, currScanLine, prevScanLine, lineSize, mBytesPerPixel);
 		if (nextFilterType == 0)
 			used0 = true;
 		else if (nextFilterType == 1)
@@ -509,12 +470,9 @@ vector<byte> PNG::filter(const byteMatrix& image)
 		else if (nextFilterType == 4)
 			used4 = true;
 
-		result.push_back( static_cast<byte>(nextFilterType) );
+		dst[0] = static_cast<byte>(nextFilterType);
 
-		for (byte elem:currScanLine)
-			result.push_back(elem);
-
-		prevScanLine = temp;
+		prevScanLine = currScanLine;
 	}
 
 	cout << "Raw data has been filtered.\n"
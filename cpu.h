@@ -0,0 +1,48 @@
+#ifndef CPU_H
+#define CPU_H
+
+/*
+Runtime CPU feature detection, used to pick between the scalar and the
+vectorized versions of hot loops. Everything is detected once and cached.
+On non-x86 targets all features report as unavailable.
+*/
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PNG_X86 1
+#endif
+
+struct CpuFeatures
+{
+	bool sse2;
+	bool ssse3;
+	bool sse41;
+	bool avx2;
+	bool pclmul;
+};
+
+const CpuFeatures& getCpuFeatures();
+
+const CpuFeatures& getCpuFeatures()
+{
+	// function-local static, so initialization is thread-safe
+	static const CpuFeatures features = []
+	{
+		CpuFeatures f = {false, false, false, false, false};
+
+#ifdef PNG_X86
+		__builtin_cpu_init();
+
+		f.sse2 = __builtin_cpu_supports("sse2");
+		f.ssse3 = __builtin_cpu_supports("ssse3");
+		f.sse41 = __builtin_cpu_supports("sse4.1");
+		f.avx2 = __builtin_cpu_supports("avx2");
+		f.pclmul = __builtin_cpu_supports("pclmul");
+#endif
+
+		return f;
+	}();
+
+	return features;
+}
+
+#endif
@@ -2,6 +2,9 @@
 #define FILTER_H
 
 #include <cmath>
+#include <string.h>
+#include <vector>
+
 #include "utils.h"
 
 /*
@@ -9,17 +12,21 @@
 	data streams. All filter types for PNG filter method 0 (the only one
 	currently defined) are included.
 
+	Scanlines are passed as pointer + length, so rows can be worked on
+	directly inside an Image buffer or a filtered data stream.
+
 	Notes on filter algorithms:
-		line vector = unfiltered scanline
+		out = destination for the filtered scanline
+		line = unfiltered scanline
 			!!! Calculations that involve a previous byte in the same
-				scanline use the RAW (unfiltered) values for those bytes. A
-				temp vector is created at the start to hold the original
-				scanline for this purpose.
-		prev vector = previous (above) unfiltered scanline
+				scanline use the RAW (unfiltered) values for those bytes.
+				The result goes to out and line is left untouched, so no
+				temp copy of the scanline is needed for this.
+		prev = previous (above) unfiltered scanline
 
 	On defilter algorithms:
-		line vector = filtered scanline
-		prev vector = previous (above) unfiltered scanline
+		line = filtered scanline, defiltered in place
+		prev = previous (above) unfiltered scanline
 		Calculations that involve the surrounding bytes still use their
 		raw (unfiltered) versions, however, as the scanlines are defiltered
 		top-to-bottom & left-to-right, there is no need to create a temp holder
@@ -32,9 +39,9 @@ byte sub(byte raw, byte left);
 
 byte deSub(byte sub, byte left);
 
-void subLine(vector<byte>& line, int bpp);
+void subLine(byte* out, const byte* line, int len, int bpp);
 
-void deSubLine(vector<byte>& line, int bpp);
+void deSubLine(byte* line, int len, int bpp);
 
 ///////////////////////////////////////////////////////////////////////////
 
@@ -42,9 +49,9 @@ byte up(byte raw, byte upper);
 
 byte deUp(byte up, byte upper);
 
-void upLine(vector<byte>& line, const vector<byte>& prev);
+void upLine(byte* out, const byte* line, const byte* prev, int len);
 
-void deUpLine(vector<byte>& line, const vector<byte>& prev);
+void deUpLine(byte* line, const byte* prev, int len);
 
 ///////////////////////////////////////////////////////////////////////////
 
@@ -52,9 +59,9 @@ byte average(byte raw, byte left, byte upper);
 
 byte deAverage(byte average, byte left, byte upper);
 
-void averageLine(vector<byte>& line, const vector<byte>& prev, int bpp);
+void averageLine(byte* out, const byte* line, const byte* prev, int len, int bpp);
 
-void deAverageLine(vector<byte>& line, const vector<byte>& prev, int bpp);
+void deAverageLine(byte* line, const byte* prev, int len, int bpp);
 
 ///////////////////////////////////////////////////////////////////////////
 
@@ -62,17 +69,23 @@ byte paeth(byte raw, byte left, byte upper, byte upperLeft);
 
 byte dePaeth(byte paeth, byte left, byte upper, byte upperLeft);
 
-void paethLine(vector<byte>& line, const vector<byte>& prev, int bpp);
+void paethLine(byte* out, const byte* line, const byte* prev, int len, int bpp);
 
-void dePaethLine(vector<byte>& line, const vector<byte>& prev, int bpp);
+void dePaethLine(byte* line, const byte* prev, int len, int bpp);
 
 byte paethPredictor(byte a, byte b, byte c);
 
 ///////////////////////////////////////////////////////////////////////////
 
-int doBestFilter(vector<byte>& line, const vector<byte>& prev, int bpp);
+void filterLine(int type, byte* out, const byte* line, const byte* prev, int len, int bpp);
+
+int doBestFilter(byte* out, const byte* line, const byte* prev, int len, int bpp);
+
+void addResiduals(long long sums[5], byte raw, byte left, byte upper, byte upperLeft);
 
-int heuristic(const vector<byte>& line);
+int pickBestFilter(const long long sums[5]);
+
+int heuristic(const byte* line, int len);
 
 ///////////////////////////////////////////////////////////////////////////
 
@@ -86,23 +99,21 @@ byte deSub(byte sub, byte left)
 	return sub + left;
 }
 
-void subLine(vector<byte>& line, int bpp)
+void subLine(byte* out, const byte* line, int len, int bpp)
 {
-	vector<byte> temp = line;
-
 	for (int x = 0; x < bpp; ++x)	// for x - bpp < 0
-		line[x] = sub( line[x], 0x00 );
+		out[x] = sub( line[x], 0x00 );
 
-	for (int x = bpp; x < line.size(); ++x)
-		line[x] = sub( line[x], temp[x - bpp] );
+	for (int x = bpp; x < len; ++x)
+		out[x] = sub( line[x], line[x - bpp] );
 }
 
-void deSubLine(vector<byte>& line, int bpp)
+void deSubLine(byte* line, int len, int bpp)
 {
 	for (int x = 0; x < bpp; ++x)	// for x - bpp < 0
 		line[x] = deSub( line[x], 0x00 );
 
-	for (int x = bpp; x < line.size(); ++x)
+	for (int x = bpp; x < len; ++x)
 		line[x] = deSub( line[x], line[x - bpp] );
 }
 
@@ -116,15 +127,15 @@ byte deUp(byte up, byte upper)
 	return up + upper;
 }
 
-void upLine(vector<byte>& line, const vector<byte>& prev)
+void upLine(byte* out, const byte* line, const byte* prev, int len)
 {
-	for (int x = 0; x < line.size(); ++x)
-		line[x] = up( line[x], prev[x] );
+	for (int x = 0; x < len; ++x)
+		out[x] = up( line[x], prev[x] );
 }
 
-void deUpLine(vector<byte>& line, const vector<byte>& prev)
+void deUpLine(byte* line, const byte* prev, int len)
 {
-	for (int x = 0; x < line.size(); ++x)
+	for (int x = 0; x < len; ++x)
 		line[x] = deUp( line[x], prev[x] );
 }
 
@@ -138,23 +149,21 @@ byte deAverage(byte average, byte left, byte upper)
 	return average + (byte)( ((int)left + (int)upper) / 2 );
 }
 
-void averageLine(vector<byte>& line, const vector<byte>& prev, int bpp)
+void averageLine(byte* out, const byte* line, const byte* prev, int len, int bpp)
 {
-	vector<byte> temp = line;
-
 	for (int x = 0; x < bpp; ++x)	// for x - bpp < 0
-		line[x] = average( line[x], 0x00, prev[x] );
+		out[x] = average( line[x], 0x00, prev[x] );
 
-	for (int x = bpp; x < line.size(); ++x)
-		line[x] = average( line[x], temp[x - bpp], prev[x] );
+	for (int x = bpp; x < len; ++x)
+		out[x] = average( line[x], line[x - bpp], prev[x] );
 }
 
-void deAverageLine(vector<byte>& line, const vector<byte>& prev, int bpp)
+void deAverageLine(byte* line, const byte* prev, int len, int bpp)
 {
 	for (int x = 0; x < bpp; ++x)	// for x - bpp < 0
 		line[x] = deAverage( line[x], 0x00, prev[x] );
 
-	for (int x = bpp; x < line.size(); ++x)
+	for (int x = bpp; x < len; ++x)
 		line[x] = deAverage( line[x], line[x - bpp], prev[x] );
 }
 
@@ -168,23 +177,21 @@ byte dePaeth(byte paeth, byte left, byte upper, byte upperLeft)
 	return paeth + paethPredictor(left, upper, upperLeft);
 }
 
-void paethLine(vector<byte>& line, const vector<byte>& prev, int bpp)
+void paethLine(byte* out, const byte* line, const byte* prev, int len, int bpp)
 {
-	vector<byte> temp = line;
-
 	for (int x = 0; x < bpp; ++x)	// for x - bpp < 0
-		line[x] = paeth( line[x], 0x00, prev[x], 0x00 );
+		out[x] = paeth( line[x], 0x00, prev[x], 0x00 );
 
-	for (int x = bpp; x < line.size(); ++x)
-		line[x] = paeth( line[x], temp[x - bpp], prev[x], prev[x - bpp] );
+	for (int x = bpp; x < len; ++x)
+		out[x] = paeth( line[x], line[x - bpp], prev[x], prev[x - bpp] );
 }
 
-void dePaethLine(vector<byte>& line, const vector<byte>& prev, int bpp)
+void dePaethLine(byte* line, const byte* prev, int len, int bpp)
 {
 	for (int x = 0; x < bpp; ++x)	// for x - bpp < 0
 		line[x] = dePaeth( line[x], 0x00, prev[x], 0x00 );
 
-	for (int x = bpp; x < line.size(); ++x)
+	for (int x = bpp; x < len; ++x)
 		line[x] = dePaeth( line[x], line[x - bpp], prev[x], prev[x - bpp] );
 }
 
@@ -204,59 +211,71 @@ byte paethPredictor(byte a, byte b, byte c)
 		return c;
 }
 
-// adaptive filtering algorithm, uses minimum sum heuristic
-int doBestFilter(vector<byte>& line, const vector<byte>& prev, int bpp)
+// filter a scanline with the given filter type (0-4) into out
+void filterLine(int type, byte* out, const byte* line, const byte* prev, int len, int bpp)
 {
-	int result, h0, h1, h2, h3, h4;
-
-	vector<byte> res1 = line, 
-		res2 = line, 
-		res3 = line, 
-		res4 = line;
-
-	subLine(res1, bpp);
-	upLine(res2, prev);
-	averageLine(res3, prev, bpp);
-	paethLine(res4, prev, bpp);
-
-	h0 = heuristic(line);
-	h1 = heuristic(res1);
-	h2 = heuristic(res2);
-	h3 = heuristic(res3);
-	h4 = heuristic(res4);
-
-	result = min( min( min(h1, h2), min(h3, h4) ), h0 );	// smallest heuristic is the best filter type
-															// for this line
-	if      (result == h0)
-		return 0;
-	else if (result == h1)
-	{
-		line = res1;
-		return 1;
-	}
-	else if (result == h2)
-	{
-		line = res2;
-		return 2;
-	}
-	else if (result == h3)
-	{
-		line = res3;
-		return 3;
-	}
+	if      (type == 0)
+		memcpy(out, line, len);
+	else if (type == 1)
+		subLine(out, line, len, bpp);
+	else if (type == 2)
+		upLine(out, line, prev, len);
+	else if (type == 3)
+		averageLine(out, line, prev, len, bpp);
 	else
-	{
-		line = res4;
-		return 4;
-	}
+		paethLine(out, line, prev, len, bpp);
+}
+
+// adaptive filtering algorithm, uses minimum sum heuristic
+// the residuals of all five filter types are summed in a single pass over
+// the scanline, then only the winning filter is written to out
+// (see filter_simd.h for the vectorized versions)
+int doBestFilter(byte* out, const byte* line, const byte* prev, int len, int bpp)
+{
+	long long sums[5] = {0, 0, 0, 0, 0};
+	int result;
+
+	for (int x = 0; x < bpp; ++x)	// for x - bpp < 0
+		addResiduals(sums, line[x], 0x00, prev[x], 0x00);
+
+	for (int x = bpp; x < len; ++x)
+		addResiduals(sums, line[x], line[x - bpp], prev[x], prev[x - bpp]);
+
+	result = pickBestFilter(sums);
+	filterLine(result, out, line, prev, len, bpp);
+
+	return result;
+}
+
+// add the heuristic() contribution of one byte to the sum of each filter type
+void addResiduals(long long sums[5], byte raw, byte left, byte upper, byte upperLeft)
+{
+	sums[0] += abs( static_cast<int>( static_cast<char>(raw) ) );
+	sums[1] += abs( static_cast<int>( static_cast<char>( sub(raw, left) ) ) );
+	sums[2] += abs( static_cast<int>( static_cast<char>( up(raw, upper) ) ) );
+	sums[3] += abs( static_cast<int>( static_cast<char>( average(raw, left, upper) ) ) );
+	sums[4] += abs( static_cast<int>( static_cast<char>( paeth(raw, left, upper, upperLeft) ) ) );
+}
+
+// smallest sum is the best filter type for this line, ties go to the
+// lower type
+int pickBestFilter(const long long sums[5])
+{
+	int result = 0;
+
+	for (int x = 1; x < 5; ++x)
+		if (sums[x] < sums[result])
+			result = x;
+
+	return result;
 }
 
-int heuristic(const vector<byte>& line)
+int heuristic(const byte* line, int len)
 {
 	int result = 0;
 
-	for (byte elem:line)
-		result += abs( static_cast<int>( static_cast<char>(elem) ) );
+	for (int x = 0; x < len; ++x)
+		result += abs( static_cast<int>( static_cast<char>(line[x]) ) );
 
 	return result;
 }
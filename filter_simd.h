@@ -0,0 +1,499 @@
+#ifndef FILTER_SIMD_H
+#define FILTER_SIMD_H
+
+#include <string.h>
+#include <stdint.h>
+
+#include "utils.h"
+#include "cpu.h"
+#include "filter.h"
+
+#ifdef PNG_X86
+#include <immintrin.h>
+#endif
+
+/*
+	Vectorized defilter kernels, picked at runtime based on what the CPU
+	supports. The plain functions in filter.h are the reference versions and
+	are used whenever no specialized kernel exists for an ISA/bpp pair.
+
+	Kernels exist for the bpp values that PNG actually produces at bit
+	depth 8 and 16 (1, 2, 3, 4, 6, 8):
+		Up      - fully data parallel, done 16 (SSE2) or 32 (AVX2) bytes at a time
+		Sub     - prefix sum of each byte lane; done as log2 shifted adds over a
+		          whole register, carrying the last pixel into the next block
+		          (bpp 3/6 need pshufb for the carry, so they start at SSSE3)
+		Average, Paeth
+		        - each pixel depends on the one to its left, so these work one
+		          pixel per register (bpp 3+). Wider registers don't help here,
+		          AVX2 uses the SSSE3 versions. bpp 1/2 use scalar code that is
+		          specialized on bpp, which is faster than a 1-2 byte vector.
+*/
+
+enum DefilterIsa
+{
+	DEFILTER_SCALAR,
+	DEFILTER_SSE2,
+	DEFILTER_SSSE3,
+	DEFILTER_AVX2
+};
+
+const int DEFILTER_ISA_COUNT = 4;
+
+// all kernels share a signature so they can live in one table, unused
+// arguments are ignored (e.g. prev for Sub)
+typedef void (*DefilterFn)(byte* line, const byte* prev, int len, int bpp);
+
+// kernel for each filter type, index 0 (None) is NULL
+struct DefilterKernels
+{
+	DefilterFn fn[5];
+};
+
+DefilterKernels getDefilterKernels(int bpp, DefilterIsa isa);
+
+DefilterIsa bestDefilterIsa();
+
+const char* defilterIsaName(DefilterIsa isa);
+
+///////////////////////////////////////////////////////////////////////////
+// reference kernels (filter.h), adapted to the common signature
+
+void deSubRef(byte* line, const byte* prev, int len, int bpp)
+{
+	deSubLine(line, len, bpp);
+}
+
+void deUpRef(byte* line, const byte* prev, int len, int bpp)
+{
+	deUpLine(line, prev, len);
+}
+
+void deAverageRef(byte* line, const byte* prev, int len, int bpp)
+{
+	deAverageLine(line, prev, len, bpp);
+}
+
+void dePaethRef(byte* line, const byte* prev, int len, int bpp)
+{
+	dePaethLine(line, prev, len, bpp);
+}
+
+///////////////////////////////////////////////////////////////////////////
+// scalar kernels specialized on bpp
+
+template<int BPP>
+void deSubScalar(byte* line, const byte* prev, int len, int bpp)
+{
+	for (int x = BPP; x < len; ++x)
+		line[x] += line[x - BPP];
+}
+
+template<int BPP>
+void deAverageScalar(byte* line, const byte* prev, int len, int bpp)
+{
+	for (int x = 0; x < BPP; ++x)
+		line[x] += prev[x] >> 1;
+
+	for (int x = BPP; x < len; ++x)
+		line[x] += (line[x - BPP] + prev[x]) >> 1;
+}
+
+template<int BPP>
+void dePaethScalar(byte* line, const byte* prev, int len, int bpp)
+{
+	// with left and upper-left both 0, the predictor is always upper
+	for (int x = 0; x < BPP; ++x)
+		line[x] += prev[x];
+
+	for (int x = BPP; x < len; ++x)
+	{
+		int a = line[x - BPP], b = prev[x], c = prev[x - BPP];
+
+		// same as paethPredictor(), with p = a + b - c folded in
+		int pa = abs(b - c);
+		int pb = abs(a - c);
+		int pc = abs(a + b - c - c);
+
+		line[x] += (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+	}
+}
+
+#ifdef PNG_X86
+
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+///////////////////////////////////////////////////////////////////////////
+// helpers
+
+// load/store a single pixel into the low bytes of a register
+// goes through memcpy so that nothing past the pixel is touched
+template<int BPP>
+TARGET_SSE2 inline __m128i loadPixel(const byte* p)
+{
+	uint64_t v = 0;
+	memcpy(&v, p, BPP);
+	return _mm_loadl_epi64( reinterpret_cast<const __m128i*>(&v) );
+}
+
+template<int BPP>
+TARGET_SSE2 inline void storePixel(byte* p, __m128i v)
+{
+	uint64_t t;
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(&t), v);
+	memcpy(p, &t, BPP);
+}
+
+// fill a register with copies of the last pixel of v (bpp 1/2/4/8)
+template<int BPP>
+TARGET_SSE2 inline __m128i broadcastLast(__m128i v)
+{
+	if (BPP == 1)
+	{
+		v = _mm_unpackhi_epi8(v, v);
+		v = _mm_shufflehi_epi16(v, 0xFF);
+		return _mm_unpackhi_epi64(v, v);
+	}
+	else if (BPP == 2)
+	{
+		v = _mm_shufflehi_epi16(v, 0xFF);
+		return _mm_unpackhi_epi64(v, v);
+	}
+	else if (BPP == 4)
+		return _mm_shuffle_epi32(v, 0xFF);
+	else
+		return _mm_unpackhi_epi64(v, v);
+}
+
+// in-register prefix sum of each byte lane for bpp 1/2/4/8,
+// i.e. the Sub defilter of 16 bytes with a left neighbour of 0
+template<int BPP>
+TARGET_SSE2 inline __m128i prefixSum(__m128i v)
+{
+	v = _mm_add_epi8( v, _mm_slli_si128(v, BPP) );
+	if (BPP < 8)
+		v = _mm_add_epi8( v, _mm_slli_si128(v, BPP < 8 ? 2 * BPP : 0) );
+	if (BPP < 4)
+		v = _mm_add_epi8( v, _mm_slli_si128(v, BPP < 4 ? 4 * BPP : 0) );
+	if (BPP < 2)
+		v = _mm_add_epi8( v, _mm_slli_si128(v, 8) );
+
+	return v;
+}
+
+// blend: mask ? x : y
+TARGET_SSE2 inline __m128i blendMask(__m128i mask, __m128i x, __m128i y)
+{
+	return _mm_or_si128( _mm_and_si128(mask, x), _mm_andnot_si128(mask, y) );
+}
+
+///////////////////////////////////////////////////////////////////////////
+// SSE2
+
+TARGET_SSE2 void deUpSse2(byte* line, const byte* prev, int len, int bpp)
+{
+	int x = 0;
+
+	for (; x + 16 <= len; x += 16)
+	{
+		__m128i d = _mm_loadu_si128( reinterpret_cast<const __m128i*>(line + x) );
+		__m128i b = _mm_loadu_si128( reinterpret_cast<const __m128i*>(prev + x) );
+		_mm_storeu_si128( reinterpret_cast<__m128i*>(line + x), _mm_add_epi8(d, b) );
+	}
+
+	for (; x < len; ++x)
+		line[x] += prev[x];
+}
+
+template<int BPP>
+TARGET_SSE2 void deSubSse2(byte* line, const byte* prev, int len, int bpp)
+{
+	__m128i carry = _mm_setzero_si128();
+	int x = 0;
+
+	for (; x + 16 <= len; x += 16)
+	{
+		__m128i d = _mm_loadu_si128( reinterpret_cast<const __m128i*>(line + x) );
+
+		d = _mm_add_epi8( prefixSum<BPP>(d), carry );
+		_mm_storeu_si128( reinterpret_cast<__m128i*>(line + x), d );
+
+		carry = broadcastLast<BPP>(d);
+	}
+
+	for (x = (x < BPP) ? BPP : x; x < len; ++x)
+		line[x] += line[x - BPP];
+}
+
+template<int BPP>
+TARGET_SSE2 void deAverageSse2(byte* line, const byte* prev, int len, int bpp)
+{
+	const __m128i one = _mm_set1_epi8(1);
+	__m128i a = _mm_setzero_si128();
+
+	for (int x = 0; x < len; x += BPP)
+	{
+		__m128i b = loadPixel<BPP>(prev + x);
+		__m128i d = loadPixel<BPP>(line + x);
+
+		// pavgb rounds up, take the rounding back off to get (a + b) / 2
+		__m128i avg = _mm_sub_epi8( _mm_avg_epu8(a, b),
+			_mm_and_si128( _mm_xor_si128(a, b), one ) );
+
+		a = _mm_add_epi8(d, avg);
+		storePixel<BPP>(line + x, a);
+	}
+}
+
+template<int BPP>
+TARGET_SSE2 void dePaethSse2(byte* line, const byte* prev, int len, int bpp)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = zero, c = zero;	// 16-bit lanes
+
+	for (int x = 0; x < len; x += BPP)
+	{
+		__m128i b = _mm_unpacklo_epi8( loadPixel<BPP>(prev + x), zero );
+		__m128i d = loadPixel<BPP>(line + x);
+
+		__m128i pa = _mm_sub_epi16(b, c);	// |p - a| = |b - c|
+		__m128i pb = _mm_sub_epi16(a, c);	// |p - b| = |a - c|
+		__m128i pc = _mm_add_epi16(pa, pb);	// |p - c| = |a + b - 2c|
+
+		pa = _mm_max_epi16( pa, _mm_sub_epi16(zero, pa) );
+		pb = _mm_max_epi16( pb, _mm_sub_epi16(zero, pb) );
+		pc = _mm_max_epi16( pc, _mm_sub_epi16(zero, pc) );
+
+		__m128i smallest = _mm_min_epi16( pc, _mm_min_epi16(pa, pb) );
+
+		// ties go to a, then b, same as paethPredictor()
+		__m128i nearest = blendMask( _mm_cmpeq_epi16(pa, smallest), a,
+			blendMask( _mm_cmpeq_epi16(pb, smallest), b, c ) );
+
+		d = _mm_add_epi8( d, _mm_packus_epi16(nearest, nearest) );
+		storePixel<BPP>(line + x, d);
+
+		a = _mm_unpacklo_epi8(d, zero);
+		c = b;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// SSSE3
+
+// Sub for bpp 3/6: 12 bytes (4 or 2 pixels) per step
+// the carry is the last pixel, spread out to every pixel slot with pshufb
+template<int BPP>
+TARGET_SSSE3 void deSubSsse3(byte* line, const byte* prev, int len, int bpp)
+{
+	const __m128i spread = (BPP == 3)
+		? _mm_setr_epi8(9, 10, 11, 9, 10, 11, 9, 10, 11, 9, 10, 11, -1, -1, -1, -1)
+		: _mm_setr_epi8(6, 7, 8, 9, 10, 11, 6, 7, 8, 9, 10, 11, -1, -1, -1, -1);
+	__m128i carry = _mm_setzero_si128();
+	int x = 0;
+
+	// 16 byte loads, but only the low 12 bytes are used and stored
+	for (; x + 16 <= len; x += 12)
+	{
+		__m128i d = _mm_loadu_si128( reinterpret_cast<const __m128i*>(line + x) );
+
+		d = _mm_add_epi8( d, _mm_slli_si128(d, BPP) );
+		if (BPP == 3)
+			d = _mm_add_epi8( d, _mm_slli_si128(d, 6) );
+		d = _mm_add_epi8(d, carry);
+
+		_mm_storel_epi64( reinterpret_cast<__m128i*>(line + x), d );
+		storePixel<4>( line + x + 8, _mm_srli_si128(d, 8) );
+
+		carry = _mm_shuffle_epi8(d, spread);
+	}
+
+	for (x = (x < BPP) ? BPP : x; x < len; ++x)
+		line[x] += line[x - BPP];
+}
+
+// identical to dePaethSse2 apart from pabsw
+template<int BPP>
+TARGET_SSSE3 void dePaethSsse3(byte* line, const byte* prev, int len, int bpp)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = zero, c = zero;
+
+	for (int x = 0; x < len; x += BPP)
+	{
+		__m128i b = _mm_unpacklo_epi8( loadPixel<BPP>(prev + x), zero );
+		__m128i d = loadPixel<BPP>(line + x);
+
+		__m128i pa = _mm_sub_epi16(b, c);
+		__m128i pb = _mm_sub_epi16(a, c);
+		__m128i pc = _mm_abs_epi16( _mm_add_epi16(pa, pb) );
+
+		pa = _mm_abs_epi16(pa);
+		pb = _mm_abs_epi16(pb);
+
+		__m128i smallest = _mm_min_epi16( pc, _mm_min_epi16(pa, pb) );
+
+		__m128i nearest = blendMask( _mm_cmpeq_epi16(pa, smallest), a,
+			blendMask( _mm_cmpeq_epi16(pb, smallest), b, c ) );
+
+		d = _mm_add_epi8( d, _mm_packus_epi16(nearest, nearest) );
+		storePixel<BPP>(line + x, d);
+
+		a = _mm_unpacklo_epi8(d, zero);
+		c = b;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+// AVX2
+
+TARGET_AVX2 void deUpAvx2(byte* line, const byte* prev, int len, int bpp)
+{
+	int x = 0;
+
+	for (; x + 32 <= len; x += 32)
+	{
+		__m256i d = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(line + x) );
+		__m256i b = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(prev + x) );
+		_mm256_storeu_si256( reinterpret_cast<__m256i*>(line + x), _mm256_add_epi8(d, b) );
+	}
+
+	for (; x < len; ++x)
+		line[x] += prev[x];
+}
+
+// 32 bytes per step: prefix sum inside each 128-bit lane, then the last
+// pixel of the low lane is carried into the high lane
+template<int BPP>
+TARGET_AVX2 void deSubAvx2(byte* line, const byte* prev, int len, int bpp)
+{
+	__m256i carry = _mm256_setzero_si256();
+	int x = 0;
+
+	for (; x + 32 <= len; x += 32)
+	{
+		__m256i d = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(line + x) );
+
+		d = _mm256_add_epi8( d, _mm256_slli_si256(d, BPP) );
+		if (BPP < 8)
+			d = _mm256_add_epi8( d, _mm256_slli_si256(d, BPP < 8 ? 2 * BPP : 0) );
+		if (BPP < 4)
+			d = _mm256_add_epi8( d, _mm256_slli_si256(d, BPP < 4 ? 4 * BPP : 0) );
+		if (BPP < 2)
+			d = _mm256_add_epi8( d, _mm256_slli_si256(d, 8) );
+
+		__m128i low = broadcastLast<BPP>( _mm256_castsi256_si128(d) );
+		d = _mm256_add_epi8( d, _mm256_inserti128_si256(_mm256_setzero_si256(), low, 1) );
+		d = _mm256_add_epi8(d, carry);
+		_mm256_storeu_si256( reinterpret_cast<__m256i*>(line + x), d );
+
+		carry = _mm256_broadcastsi128_si256( broadcastLast<BPP>( _mm256_extracti128_si256(d, 1) ) );
+	}
+
+	for (x = (x < BPP) ? BPP : x; x < len; ++x)
+		line[x] += line[x - BPP];
+}
+
+#endif // PNG_X86
+
+///////////////////////////////////////////////////////////////////////////
+// dispatch
+
+DefilterKernels referenceKernels()
+{
+	DefilterKernels k = {{ NULL, deSubRef, deUpRef, deAverageRef, dePaethRef }};
+
+	return k;
+}
+
+// kernels for a single bpp, each ISA starts from the set of the one below it
+template<int BPP>
+DefilterKernels kernelsFor(DefilterIsa isa)
+{
+	DefilterKernels k = referenceKernels();
+
+	if (isa == DEFILTER_SCALAR)
+		return k;
+
+	k.fn[1] = deSubScalar<BPP>;
+	k.fn[3] = deAverageScalar<BPP>;
+	k.fn[4] = dePaethScalar<BPP>;
+
+#ifdef PNG_X86
+	k.fn[2] = deUpSse2;
+
+	if (BPP == 1 || BPP == 2 || BPP == 4 || BPP == 8)
+		k.fn[1] = deSubSse2<BPP>;
+
+	if (BPP >= 3)
+	{
+		k.fn[3] = deAverageSse2<BPP>;
+		k.fn[4] = dePaethSse2<BPP>;
+	}
+
+	if (isa >= DEFILTER_SSSE3)
+	{
+		if (BPP == 3 || BPP == 6)
+			k.fn[1] = deSubSsse3<BPP>;
+
+		if (BPP >= 3)
+			k.fn[4] = dePaethSsse3<BPP>;
+	}
+
+	if (isa >= DEFILTER_AVX2)
+	{
+		k.fn[2] = deUpAvx2;
+
+		if (BPP == 1 || BPP == 2 || BPP == 4 || BPP == 8)
+			k.fn[1] = deSubAvx2<BPP>;
+	}
+#endif
+
+	return k;
+}
+
+// returns the defilter kernels for the given bpp and ISA
+// the ISA must be supported by the CPU (see bestDefilterIsa())
+DefilterKernels getDefilterKernels(int bpp, DefilterIsa isa)
+{
+	switch (bpp)
+	{
+	case 1: return kernelsFor<1>(isa);
+	case 2: return kernelsFor<2>(isa);
+	case 3: return kernelsFor<3>(isa);
+	case 4: return kernelsFor<4>(isa);
+	case 6: return kernelsFor<6>(isa);
+	case 8: return kernelsFor<8>(isa);
+	default: return referenceKernels();
+	}
+}
+
+// most capable ISA supported by this CPU
+DefilterIsa bestDefilterIsa()
+{
+	const CpuFeatures& cpu = getCpuFeatures();
+
+	if (cpu.avx2)
+		return DEFILTER_AVX2;
+	if (cpu.ssse3)
+		return DEFILTER_SSSE3;
+	if (cpu.sse2)
+		return DEFILTER_SSE2;
+
+	return DEFILTER_SCALAR;
+}
+
+const char* defilterIsaName(DefilterIsa isa)
+{
+	switch (isa)
+	{
+	case DEFILTER_SSE2: return "sse2";
+	case DEFILTER_SSSE3: return "ssse3";
+	case DEFILTER_AVX2: return "avx2";
+	default: return "scalar";
+	}
+}
+
+#endif
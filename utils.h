@@ -34,6 +34,9 @@ vector<byte> toVec(unsigned int val);
 template<typename T>
 bool allSame(const vector<T>& vec, int n);
 
+template<typename T>
+bool allSame(const T* arr, int n);
+
 template<typename T>
 bool contains(const vector<T>& vec, T item);
 
@@ -124,6 +127,17 @@ bool allSame(const vector<T>& vec, int n)
 	return true;
 }
 
+// same as above, for a plain array (e.g. a pixel inside an Image)
+template<typename T>
+bool allSame(const T* arr, int n)
+{
+	for (int x = 1; x < n; ++x)
+		if ( arr[x] != arr[x - 1] )
+			return false;
+
+	return true;
+}
+
 // returns true if given item is present in the given vector
 template<typename T>
 bool contains(const vector<T>& vec, T item)